@@ -1,9 +1,15 @@
+#include <cassert>
 #include <cctype>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <typeinfo>
 #include <utility>
 #include <vector>
 
@@ -21,12 +27,48 @@ enum Token {
     
     // Primary
     tok_identifier = -4,
-    tok_number = -5
+    tok_number = -5,
+    
+    // Control
+    tok_if = -6,
+    tok_then = -7,
+    tok_else = -8,
+    tok_for = -9,
+    tok_in = -10,
+    
+    // Variables
+    tok_var = -11,
+    
+    // Operators
+    tok_binary = -12,
+    tok_unary = -13,
+    
+    // Parallelism
+    tok_parallel = -14,
+    
+    // Transformations
+    tok_grad = -15
 };
 
 static std::string IdentifierStr;
 static double NumVal;
 
+/// SinglePrecision — whether the session computes in float instead of double
+static bool SinglePrecision = false;
+
+/// FastMathFlags — floating-point relaxations allowed for the session
+struct FastMathFlags {
+    bool AllowContract = false; // a * b + c may become a fused multiply-add
+    bool AllowReassoc = false;  // (a + b) + c may become a + (b + c)
+    bool NoNaNs = false;        // Operands and results are never NaN
+    bool NoInfs = false;        // Operands and results are never infinite
+};
+
+static FastMathFlags FastMath;
+
+/// DumpAST — whether every parsed item is printed back as an s-expression
+static bool DumpAST = false;
+
 /// gettok — returns next token from standard input
 static int gettok() {
     static int LastChar = ' ';
@@ -49,6 +91,36 @@ static int gettok() {
         if (IdentifierStr == "extern") {
             return tok_extern;
         }
+        if (IdentifierStr == "if") {
+            return tok_if;
+        }
+        if (IdentifierStr == "then") {
+            return tok_then;
+        }
+        if (IdentifierStr == "else") {
+            return tok_else;
+        }
+        if (IdentifierStr == "for") {
+            return tok_for;
+        }
+        if (IdentifierStr == "in") {
+            return tok_in;
+        }
+        if (IdentifierStr == "var") {
+            return tok_var;
+        }
+        if (IdentifierStr == "binary") {
+            return tok_binary;
+        }
+        if (IdentifierStr == "unary") {
+            return tok_unary;
+        }
+        if (IdentifierStr == "parallel") {
+            return tok_parallel;
+        }
+        if (IdentifierStr == "grad") {
+            return tok_grad;
+        }
         return tok_identifier;
     }
     
@@ -60,7 +132,13 @@ static int gettok() {
             LastChar = getchar();
         } while (isdigit(LastChar) || LastChar == '.');
         
-        NumVal = strtod(NumStr.c_str(), nullptr);
+        // Rounding literals once, so float mode never sees a double value
+        if (SinglePrecision) {
+            NumVal = strtof(NumStr.c_str(), nullptr);
+        }
+        else {
+            NumVal = strtod(NumStr.c_str(), nullptr);
+        }
         return tok_number;
     }
     
@@ -95,6 +173,16 @@ namespace {
 class ExprAST {
 public:
     virtual ~ExprAST() = default;
+    
+    /// dump — prints the expression to stderr as an s-expression
+    virtual void dump() const = 0;
+    
+    /// clone — returns a deep copy of the expression
+    virtual std::unique_ptr<ExprAST> clone() const = 0;
+    
+    /// children — returns the owning pointers of all direct subexpressions,
+    /// letting passes walk and rewrite trees without knowing every node kind
+    virtual std::vector<std::unique_ptr<ExprAST> *> children() { return {}; }
 };
 
 /// NumberExprAST — expression class for numeric literals
@@ -103,6 +191,14 @@ class NumberExprAST : public ExprAST {
     
 public:
     NumberExprAST(double Val) : Val(Val) {}
+    
+    double getVal() const { return Val; }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        return std::make_unique<NumberExprAST>(Val);
+    }
+    
+    void dump() const override { fprintf(stderr, "%.17g", Val); }
 };
 
 /// VariableExprAST — expression class for referencing a variable
@@ -111,6 +207,99 @@ class VariableExprAST : public ExprAST {
     
 public:
     VariableExprAST(const std::string &Name) : Name(Name) {}
+    
+    const std::string &getName() const { return Name; }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        return std::make_unique<VariableExprAST>(Name);
+    }
+    
+    void dump() const override { fprintf(stderr, "%s", Name.c_str()); }
+};
+
+/// VectorExprAST — expression class for fixed-width vector literals
+class VectorExprAST : public ExprAST {
+    std::vector<std::unique_ptr<ExprAST>> Lanes;
+    
+public:
+    VectorExprAST(std::vector<std::unique_ptr<ExprAST>> Lanes)
+        : Lanes(std::move(Lanes)) {}
+    
+    std::vector<std::unique_ptr<ExprAST> *> children() override {
+        std::vector<std::unique_ptr<ExprAST> *> Result;
+        for (auto &Lane : Lanes) {
+            Result.push_back(&Lane);
+        }
+        return Result;
+    }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        std::vector<std::unique_ptr<ExprAST>> LanesCopy;
+        for (auto &Lane : Lanes) {
+            LanesCopy.push_back(Lane->clone());
+        }
+        return std::make_unique<VectorExprAST>(std::move(LanesCopy));
+    }
+    
+    void dump() const override {
+        fprintf(stderr, "(vector");
+        for (auto &Lane : Lanes) {
+            fprintf(stderr, " ");
+            Lane->dump();
+        }
+        fprintf(stderr, ")");
+    }
+};
+
+/// IndexExprAST — expression class for accessing a lane of a vector or an
+/// element of an array argument
+class IndexExprAST : public ExprAST {
+    std::string Name;
+    std::unique_ptr<ExprAST> Index;
+    
+public:
+    IndexExprAST(const std::string &Name, std::unique_ptr<ExprAST> Index)
+        : Name(Name), Index(std::move(Index)) {}
+    
+    std::vector<std::unique_ptr<ExprAST> *> children() override {
+        return {&Index};
+    }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        return std::make_unique<IndexExprAST>(Name, Index->clone());
+    }
+    
+    void dump() const override {
+        fprintf(stderr, "(index %s ", Name.c_str());
+        Index->dump();
+        fprintf(stderr, ")");
+    }
+};
+
+/// UnaryExprAST — expression class for a unary operator
+class UnaryExprAST : public ExprAST {
+    char Opcode;
+    std::unique_ptr<ExprAST> Operand;
+    
+public:
+    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
+        : Opcode(Opcode), Operand(std::move(Operand)) {}
+    
+    char getOpcode() const { return Opcode; }
+    
+    std::vector<std::unique_ptr<ExprAST> *> children() override {
+        return {&Operand};
+    }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        return std::make_unique<UnaryExprAST>(Opcode, Operand->clone());
+    }
+    
+    void dump() const override {
+        fprintf(stderr, "(unary%c ", Opcode);
+        Operand->dump();
+        fprintf(stderr, ")");
+    }
 };
 
 /// BinaryExprAST — expression class for a binary operator
@@ -122,6 +311,24 @@ public:
     BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
                   std::unique_ptr<ExprAST> RHS)
         : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    
+    char getOp() const { return Op; }
+    
+    std::vector<std::unique_ptr<ExprAST> *> children() override {
+        return {&LHS, &RHS};
+    }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        return std::make_unique<BinaryExprAST>(Op, LHS->clone(), RHS->clone());
+    }
+    
+    void dump() const override {
+        fprintf(stderr, "(%c ", Op);
+        LHS->dump();
+        fprintf(stderr, " ");
+        RHS->dump();
+        fprintf(stderr, ")");
+    }
 };
 
 /// CallExprAST — expression class for function calls
@@ -133,29 +340,279 @@ public:
     CallExprAST(const std::string &Callee,
                 std::vector<std::unique_ptr<ExprAST>> Args)
         : Callee(Callee), Args(std::move(Args)) {}
+    
+    const std::string &getCallee() const { return Callee; }
+    
+    std::vector<std::unique_ptr<ExprAST> *> children() override {
+        std::vector<std::unique_ptr<ExprAST> *> Result;
+        for (auto &Arg : Args) {
+            Result.push_back(&Arg);
+        }
+        return Result;
+    }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        std::vector<std::unique_ptr<ExprAST>> ArgsCopy;
+        for (auto &Arg : Args) {
+            ArgsCopy.push_back(Arg->clone());
+        }
+        return std::make_unique<CallExprAST>(Callee, std::move(ArgsCopy));
+    }
+    
+    void dump() const override {
+        fprintf(stderr, "(call %s", Callee.c_str());
+        for (auto &Arg : Args) {
+            fprintf(stderr, " ");
+            Arg->dump();
+        }
+        fprintf(stderr, ")");
+    }
+};
+
+/// IfExprAST — expression class for if/then/else
+class IfExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Cond, Then, Else;
+    
+public:
+    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
+              std::unique_ptr<ExprAST> Else)
+        : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+    
+    std::vector<std::unique_ptr<ExprAST> *> children() override {
+        return {&Cond, &Then, &Else};
+    }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        return std::make_unique<IfExprAST>(Cond->clone(), Then->clone(),
+                                           Else->clone());
+    }
+    
+    void dump() const override {
+        fprintf(stderr, "(if ");
+        Cond->dump();
+        fprintf(stderr, " ");
+        Then->dump();
+        fprintf(stderr, " ");
+        Else->dump();
+        fprintf(stderr, ")");
+    }
+};
+
+/// ForExprAST — expression class for for/in
+class ForExprAST : public ExprAST {
+    std::string VarName;
+    std::unique_ptr<ExprAST> Start, End, Step, Body;
+    
+public:
+    ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
+               std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
+               std::unique_ptr<ExprAST> Body)
+        : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
+          Step(std::move(Step)), Body(std::move(Body)) {}
+    
+    const std::string &getVarName() const { return VarName; }
+    
+    std::vector<std::unique_ptr<ExprAST> *> children() override {
+        if (!Step) {
+            return {&Start, &End, &Body};
+        }
+        return {&Start, &End, &Step, &Body};
+    }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        return std::make_unique<ForExprAST>(VarName, Start->clone(), End->clone(),
+                                            Step ? Step->clone() : nullptr,
+                                            Body->clone());
+    }
+    
+    void dump() const override {
+        fprintf(stderr, "(for %s ", VarName.c_str());
+        Start->dump();
+        fprintf(stderr, " ");
+        End->dump();
+        fprintf(stderr, " ");
+        if (Step) {
+            Step->dump();
+        }
+        else {
+            fprintf(stderr, "1");
+        }
+        fprintf(stderr, " ");
+        Body->dump();
+        fprintf(stderr, ")");
+    }
+};
+
+/// ParallelExprAST — expression class for 'parallel for' and 'parallel sum',
+/// whose iterations over [Start, End) may run on any worker thread
+class ParallelExprAST : public ExprAST {
+    bool IsSum;
+    bool Deterministic; // Sum must not depend on how iterations were split
+    std::string VarName;
+    std::unique_ptr<ExprAST> Start, End, Body;
+    
+public:
+    ParallelExprAST(bool IsSum, bool Deterministic, const std::string &VarName,
+                    std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
+                    std::unique_ptr<ExprAST> Body)
+        : IsSum(IsSum), Deterministic(Deterministic), VarName(VarName),
+          Start(std::move(Start)), End(std::move(End)), Body(std::move(Body)) {}
+    
+    const std::string &getVarName() const { return VarName; }
+    
+    std::vector<std::unique_ptr<ExprAST> *> children() override {
+        return {&Start, &End, &Body};
+    }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        return std::make_unique<ParallelExprAST>(IsSum, Deterministic, VarName,
+                                                 Start->clone(), End->clone(),
+                                                 Body->clone());
+    }
+    
+    void dump() const override {
+        fprintf(stderr, "(parallel-%s%s %s ", IsSum ? "sum" : "for",
+                Deterministic ? "-deterministic" : "", VarName.c_str());
+        Start->dump();
+        fprintf(stderr, " ");
+        End->dump();
+        fprintf(stderr, " ");
+        Body->dump();
+        fprintf(stderr, ")");
+    }
+};
+
+/// VarExprAST — expression class for var/in
+class VarExprAST : public ExprAST {
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    std::unique_ptr<ExprAST> Body;
+    
+public:
+    VarExprAST(
+        std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
+        std::unique_ptr<ExprAST> Body)
+        : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+    
+    const std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> &
+    getVarNames() const {
+        return VarNames;
+    }
+    ExprAST &getBody() { return *Body; }
+    
+    bool declares(const std::string &Name) const {
+        for (auto &Var : VarNames) {
+            if (Var.first == Name) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    std::vector<std::unique_ptr<ExprAST> *> children() override {
+        std::vector<std::unique_ptr<ExprAST> *> Result;
+        for (auto &Var : VarNames) {
+            if (Var.second) {
+                Result.push_back(&Var.second);
+            }
+        }
+        Result.push_back(&Body);
+        return Result;
+    }
+    
+    std::unique_ptr<ExprAST> clone() const override {
+        std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarsCopy;
+        for (auto &Var : VarNames) {
+            VarsCopy.push_back(std::make_pair(
+                Var.first, Var.second ? Var.second->clone() : nullptr));
+        }
+        return std::make_unique<VarExprAST>(std::move(VarsCopy), Body->clone());
+    }
+    
+    void dump() const override {
+        fprintf(stderr, "(var (");
+        for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+            fprintf(stderr, i ? " (%s " : "(%s ", VarNames[i].first.c_str());
+            if (VarNames[i].second) {
+                VarNames[i].second->dump();
+            }
+            else {
+                fprintf(stderr, "0");
+            }
+            fprintf(stderr, ")");
+        }
+        fprintf(stderr, ") ");
+        Body->dump();
+        fprintf(stderr, ")");
+    }
 };
 
-/// PrototypeAST — class for a function prototype
+/// PrototypeAST — class for a function prototype, including the
+/// user-defined operators
 class PrototypeAST {
     std::string Name;
     std::vector<std::string> Args;
+    std::vector<bool> ArrayArgs; // Array arguments are caller-owned memory
+    bool IsOperator;
+    unsigned Precedence; // Precedence if a binary operator
     
 public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-        : Name(Name), Args(std::move(Args)) {}
+    PrototypeAST(const std::string &Name, std::vector<std::string> Args,
+                 bool IsOperator = false, unsigned Prec = 0,
+                 std::vector<bool> ArrayArgs = std::vector<bool>())
+        : Name(Name), Args(std::move(Args)), ArrayArgs(std::move(ArrayArgs)),
+          IsOperator(IsOperator), Precedence(Prec) {
+        this->ArrayArgs.resize(this->Args.size(), false);
+    }
     
     const std::string &getName() const { return Name; }
+    const std::vector<std::string> &getArgs() const { return Args; }
+    
+    bool isArrayArg(unsigned Idx) const { return ArrayArgs[Idx]; }
+    
+    bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
+    bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
+    
+    char getOperatorName() const {
+        assert(isUnaryOp() || isBinaryOp());
+        return Name[Name.size() - 1];
+    }
+    
+    unsigned getBinaryPrecedence() const { return Precedence; }
+    
+    void dump() const {
+        fprintf(stderr, "%s(", Name.c_str());
+        for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+            fprintf(stderr, i ? " %s%s" : "%s%s", Args[i].c_str(),
+                    ArrayArgs[i] ? "[]" : "");
+        }
+        fprintf(stderr, ")");
+    }
 };
 
 /// FunctionAST — class for a function definition itself
 class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto;
     std::unique_ptr<ExprAST> Body;
+    std::unique_ptr<ExprAST> ParsedBody; // the body before any pass ran
     
 public:
     FunctionAST(std::unique_ptr<PrototypeAST> Proto,
                 std::unique_ptr<ExprAST> Body)
-        : Proto(std::move(Proto)), Body(std::move(Body)) {}
+        : Proto(std::move(Proto)), Body(std::move(Body)),
+          ParsedBody(this->Body->clone()) {}
+    
+    const PrototypeAST &getProto() const { return *Proto; }
+    ExprAST &getBody() { return *Body; }
+    std::unique_ptr<ExprAST> &getBodySlot() { return Body; }
+    ExprAST &getParsedBody() { return *ParsedBody; }
+    
+    void dump() const {
+        fprintf(stderr, "def ");
+        Proto->dump();
+        fprintf(stderr, " ");
+        Body->dump();
+        fprintf(stderr, "\n");
+    }
 };
 
 } // end anonymous namespace
@@ -170,6 +627,15 @@ static int getNextToken() { return CurTok = gettok(); }
 /// BinopPrecedence — holds precedence for each defined binary operator
 static std::map<char, int> BinopPrecedence;
 
+/// UnaryOperators — holds every user-defined unary operator
+static std::set<char> UnaryOperators;
+
+/// BuiltinArity — holds operand count for each built-in math intrinsic
+static std::map<std::string, unsigned> BuiltinArity;
+
+/// VectorWidth — number of lanes in a vector value
+static const unsigned VectorWidth = 4;
+
 /// GetTokPrecedence — provides precedence of pending binary operator token
 static int GetTokPrecedence() {
     if (!isascii(CurTok)) {
@@ -218,14 +684,63 @@ static std::unique_ptr <ExprAST> ParseParenExpr() {
     return V;
 }
 
+/// vectorexpr ::= '[' expression (',' expression)* ']'
+static std::unique_ptr<ExprAST> ParseVectorExpr() {
+    // Consuming '['
+    getNextToken();
+    
+    std::vector<std::unique_ptr<ExprAST>> Lanes;
+    while (true) {
+        auto Lane = ParseExpression();
+        if (!Lane) {
+            return nullptr;
+        }
+        Lanes.push_back(std::move(Lane));
+        
+        if (CurTok == ']') {
+            break;
+        }
+        
+        if (CurTok != ',') {
+            return LogError("expected ']' or ',' in vector literal");
+        }
+        getNextToken();
+    }
+    
+    getNextToken();
+    
+    if (Lanes.size() != VectorWidth) {
+        std::string Msg = "vector literal must have exactly " +
+                          std::to_string(VectorWidth) + " lanes";
+        return LogError(Msg.c_str());
+    }
+    
+    return std::make_unique<VectorExprAST>(std::move(Lanes));
+}
+
 /// identifierexpr
 ///     ::= identifier
+///     ::= identifier '[' expression ']'
 ///     ::= identifier '(' expression* ')'
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     std::string IdName = IdentifierStr;
     
     getNextToken();
     
+    if (CurTok == '[') {
+        getNextToken();
+        auto Index = ParseExpression();
+        if (!Index) {
+            return nullptr;
+        }
+        
+        if (CurTok != ']') {
+            return LogError("expected ']'");
+        }
+        getNextToken();
+        return std::make_unique<IndexExprAST>(IdName, std::move(Index));
+    }
+    
     if (CurTok != '(') {
         return std::make_unique<VariableExprAST>(IdName);
     }
@@ -254,137 +769,2127 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     
     getNextToken();
     
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
-}
-
-/// primary
-///     ::= identifierexpr
-///     ::= numberexpr
-///     ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
-    switch (CurTok) {
-    default:
-        return LogError("unknown token when expecting an expression");
-    case tok_identifier:
-        return ParseIdentifierExpr();
-    case tok_number:
-        return ParseNumberExpr();
-    case '(':
-        return ParseParenExpr();
-    }
-}
-
-/// binoprhs
-///     ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
-    // Searching for precedence
-    while (true) {
-        int TokPrec = GetTokPrecedence();
-        
-        // Consuming target binop 
-        if (TokPrec < ExprPrec) {
-            return LHS;
-        }
-        
-        int BinOp = CurTok;
-        getNextToken();
-        
-        // Parsing primary expression after binary operator
-        auto RHS = ParsePrimary();
-        if (!RHS) {
-            return nullptr;
-        }
-        
-        int NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-            if (!RHS) {
-                return nullptr;
-            }
-        }
-        
-        LHS =
-            std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    // Built-in intrinsics need no extern but take a fixed number of operands
+    auto Builtin = BuiltinArity.find(IdName);
+    if (Builtin != BuiltinArity.end() && Builtin->second != Args.size()) {
+        return LogError("incorrect number of arguments passed to builtin");
     }
+    
+    return std::make_unique<CallExprAST>(IdName, std::move(Args));
 }
 
-/// expression
-///     ::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParsePrimary();
-    if (!LHS) {
+/// ifexpr ::= 'if' expression 'then' expression 'else' expression
+static std::unique_ptr<ExprAST> ParseIfExpr() {
+    // Consuming 'if'
+    getNextToken();
+    
+    auto Cond = ParseExpression();
+    if (!Cond) {
         return nullptr;
     }
     
-    return ParseBinOpRHS(0, std::move(LHS));
-}
-
-/// prototype
-///     ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-    if (CurTok != tok_identifier) {
-        return LogErrorP("expected function name in prototype");
+    if (CurTok != tok_then) {
+        return LogError("expected then");
     }
-    
-    std::string FnName = IdentifierStr;
     getNextToken();
     
-    if (CurTok != '(') {
-        return LogErrorP("expected '(' in prototype");
+    auto Then = ParseExpression();
+    if (!Then) {
+        return nullptr;
     }
     
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier) {
+    if (CurTok != tok_else) {
+        return LogError("expected else");
+    }
+    getNextToken();
+    
+    auto Else = ParseExpression();
+    if (!Else) {
+        return nullptr;
+    }
+    
+    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
+                                       std::move(Else));
+}
+
+/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+static std::unique_ptr<ExprAST> ParseForExpr() {
+    // Consuming 'for'
+    getNextToken();
+    
+    if (CurTok != tok_identifier) {
+        return LogError("expected identifier after for");
+    }
+    
+    std::string IdName = IdentifierStr;
+    getNextToken();
+    
+    if (CurTok != '=') {
+        return LogError("expected '=' after for");
+    }
+    getNextToken();
+    
+    auto Start = ParseExpression();
+    if (!Start) {
+        return nullptr;
+    }
+    if (CurTok != ',') {
+        return LogError("expected ',' after for start value");
+    }
+    getNextToken();
+    
+    auto End = ParseExpression();
+    if (!End) {
+        return nullptr;
+    }
+    
+    // Step value is optional
+    std::unique_ptr<ExprAST> Step;
+    if (CurTok == ',') {
+        getNextToken();
+        Step = ParseExpression();
+        if (!Step) {
+            return nullptr;
+        }
+    }
+    
+    if (CurTok != tok_in) {
+        return LogError("expected 'in' after for");
+    }
+    getNextToken();
+    
+    auto Body = ParseExpression();
+    if (!Body) {
+        return nullptr;
+    }
+    
+    return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
+                                        std::move(Step), std::move(Body));
+}
+
+/// parallelexpr
+///     ::= 'parallel' 'for' identifier '=' expr ',' expr 'in' expression
+///     ::= 'parallel' 'sum' 'deterministic'? identifier '=' expr ',' expr
+///             'in' expression
+static std::unique_ptr<ExprAST> ParseParallelExpr() {
+    // Consuming 'parallel'
+    getNextToken();
+    
+    bool IsSum = false;
+    if (CurTok == tok_identifier && IdentifierStr == "sum") {
+        IsSum = true;
+    }
+    else if (CurTok != tok_for) {
+        return LogError("expected 'for' or 'sum' after parallel");
+    }
+    getNextToken();
+    
+    if (CurTok != tok_identifier) {
+        return LogError("expected identifier after parallel");
+    }
+    
+    std::string IdName = IdentifierStr;
+    getNextToken();
+    
+    // 'deterministic' is only a keyword when a loop variable follows it
+    bool Deterministic = false;
+    if (IsSum && IdName == "deterministic" && CurTok == tok_identifier) {
+        Deterministic = true;
+        IdName = IdentifierStr;
+        getNextToken();
+    }
+    
+    if (CurTok != '=') {
+        return LogError("expected '=' after parallel");
+    }
+    getNextToken();
+    
+    auto Start = ParseExpression();
+    if (!Start) {
+        return nullptr;
+    }
+    if (CurTok != ',') {
+        return LogError("expected ',' after parallel start value");
+    }
+    getNextToken();
+    
+    auto End = ParseExpression();
+    if (!End) {
+        return nullptr;
+    }
+    
+    if (CurTok != tok_in) {
+        return LogError("expected 'in' after parallel");
+    }
+    getNextToken();
+    
+    auto Body = ParseExpression();
+    if (!Body) {
+        return nullptr;
+    }
+    
+    return std::make_unique<ParallelExprAST>(IsSum, Deterministic, IdName,
+                                             std::move(Start), std::move(End),
+                                             std::move(Body));
+}
+
+/// varexpr ::= 'var' identifier ('=' expression)?
+///                    (',' identifier ('=' expression)?)* 'in' expression
+static std::unique_ptr<ExprAST> ParseVarExpr() {
+    // Consuming 'var'
+    getNextToken();
+    
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    
+    // At least one variable name is required
+    if (CurTok != tok_identifier) {
+        return LogError("expected identifier after var");
+    }
+    
+    while (true) {
+        std::string Name = IdentifierStr;
+        getNextToken();
+        
+        // Initializer is optional
+        std::unique_ptr<ExprAST> Init;
+        if (CurTok == '=') {
+            getNextToken();
+            
+            Init = ParseExpression();
+            if (!Init) {
+                return nullptr;
+            }
+        }
+        
+        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        
+        // End of var list
+        if (CurTok != ',') {
+            break;
+        }
+        getNextToken();
+        
+        if (CurTok != tok_identifier) {
+            return LogError("expected identifier list after var");
+        }
+    }
+    
+    if (CurTok != tok_in) {
+        return LogError("expected 'in' keyword after 'var'");
+    }
+    getNextToken();
+    
+    auto Body = ParseExpression();
+    if (!Body) {
+        return nullptr;
+    }
+    
+    return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+}
+
+/// primary
+///     ::= identifierexpr
+///     ::= numberexpr
+///     ::= parenexpr
+///     ::= ifexpr
+///     ::= forexpr
+///     ::= varexpr
+///     ::= vectorexpr
+///     ::= parallelexpr
+static std::unique_ptr<ExprAST> ParsePrimary() {
+    switch (CurTok) {
+    default:
+        return LogError("unknown token when expecting an expression");
+    case tok_identifier:
+        return ParseIdentifierExpr();
+    case tok_number:
+        return ParseNumberExpr();
+    case '(':
+        return ParseParenExpr();
+    case tok_if:
+        return ParseIfExpr();
+    case tok_for:
+        return ParseForExpr();
+    case tok_var:
+        return ParseVarExpr();
+    case '[':
+        return ParseVectorExpr();
+    case tok_parallel:
+        return ParseParallelExpr();
+    }
+}
+
+/// unary
+///     ::= primary
+///     ::= '!' unary
+static std::unique_ptr<ExprAST> ParseUnary() {
+    // If the current token is not a defined unary operator, it must be a
+    // primary expression; this leaves ';' and ')' alone for error recovery
+    if (!isascii(CurTok) || !UnaryOperators.count(CurTok)) {
+        return ParsePrimary();
+    }
+    
+    // If this is a unary operator, reading it
+    int Opc = CurTok;
+    getNextToken();
+    if (auto Operand = ParseUnary()) {
+        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+    }
+    return nullptr;
+}
+
+/// binoprhs
+///     ::= ('+' unary)*
+static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
+                                              std::unique_ptr<ExprAST> LHS) {
+    // Searching for precedence
+    while (true) {
+        int TokPrec = GetTokPrecedence();
+        
+        // Consuming target binop 
+        if (TokPrec < ExprPrec) {
+            return LHS;
+        }
+        
+        int BinOp = CurTok;
+        getNextToken();
+        
+        // Assignment only makes sense with a variable on the left-hand side
+        if (BinOp == '=' && !dynamic_cast<VariableExprAST *>(LHS.get())) {
+            return LogError("destination of '=' must be a variable");
+        }
+        
+        // Parsing unary expression after binary operator
+        auto RHS = ParseUnary();
+        if (!RHS) {
+            return nullptr;
+        }
+        
+        int NextPrec = GetTokPrecedence();
+        if (TokPrec < NextPrec) {
+            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+            if (!RHS) {
+                return nullptr;
+            }
+        }
+        
+        LHS =
+            std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    }
+}
+
+/// expression
+///     ::= unary binoprhs
+static std::unique_ptr<ExprAST> ParseExpression() {
+    auto LHS = ParseUnary();
+    if (!LHS) {
+        return nullptr;
+    }
+    
+    return ParseBinOpRHS(0, std::move(LHS));
+}
+
+/// prototype
+///     ::= id '(' (id | id '[' ']')* ')'
+///     ::= binary LETTER number? (id, id)
+///     ::= unary LETTER (id)
+static std::unique_ptr<PrototypeAST> ParsePrototype() {
+    std::string FnName;
+    
+    unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary
+    unsigned BinaryPrecedence = 30;
+    
+    switch (CurTok) {
+    default:
+        return LogErrorP("expected function name in prototype");
+    case tok_identifier:
+        FnName = IdentifierStr;
+        Kind = 0;
+        getNextToken();
+        break;
+    case tok_unary:
+        getNextToken();
+        if (!isascii(CurTok)) {
+            return LogErrorP("expected unary operator");
+        }
+        FnName = "unary";
+        FnName += (char)CurTok;
+        Kind = 1;
+        getNextToken();
+        break;
+    case tok_binary:
+        getNextToken();
+        if (!isascii(CurTok)) {
+            return LogErrorP("expected binary operator");
+        }
+        FnName = "binary";
+        FnName += (char)CurTok;
+        Kind = 2;
+        getNextToken();
+        
+        // Reading the precedence if present
+        if (CurTok == tok_number) {
+            if (NumVal < 1 || NumVal > 100) {
+                return LogErrorP("invalid precedence: must be 1..100");
+            }
+            BinaryPrecedence = (unsigned)NumVal;
+            getNextToken();
+        }
+        break;
+    }
+    
+    if (CurTok != '(') {
+        return LogErrorP("expected '(' in prototype");
+    }
+    
+    std::vector<std::string> ArgNames;
+    std::vector<bool> ArrayArgs;
+    bool HasArrayArgs = false;
+    getNextToken();
+    while (CurTok == tok_identifier) {
         ArgNames.push_back(IdentifierStr);
+        getNextToken();
+        
+        // Array argument: id '[' ']'
+        bool IsArray = CurTok == '[';
+        if (IsArray) {
+            if (getNextToken() != ']') {
+                return LogErrorP("expected ']' in array argument");
+            }
+            getNextToken();
+            HasArrayArgs = true;
+        }
+        ArrayArgs.push_back(IsArray);
+    }
+    if (CurTok != ')') {
+        return LogErrorP("expected ')' in prototype");
+    }
+    
+    getNextToken();
+    
+    // Verifying right number of names for operator
+    if (Kind && ArgNames.size() != Kind) {
+        return LogErrorP("invalid number of operands for operator");
+    }
+    if (Kind && HasArrayArgs) {
+        return LogErrorP("operator operands cannot be arrays");
+    }
+    
+    // Calls to a built-in name are checked against its operand count, so a
+    // definition or extern may only shadow it with the same number of them
+    auto Builtin = BuiltinArity.find(FnName);
+    if (Builtin != BuiltinArity.end() && Builtin->second != ArgNames.size()) {
+        return LogErrorP("incorrect number of arguments for builtin prototype");
+    }
+    
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0,
+                                          BinaryPrecedence, std::move(ArrayArgs));
+}
+
+/// definition ::= 'def' prototype expression
+static std::unique_ptr<FunctionAST> ParseDefinition() {
+    getNextToken();
+    auto Proto = ParsePrototype();
+    if (!Proto) {
+        return nullptr;
+    }
+    
+    if (auto E = ParseExpression()) {
+        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    }
+    return nullptr;
+}
+
+/// toplevelexpr ::= expression
+static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+    if (auto E = ParseExpression()) {
+        // Making anonymous proto
+        auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
+                                                    std::vector<std::string>());
+        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    }
+    return nullptr;
+}
+
+/// external ::= 'extern' prototype
+static std::unique_ptr<PrototypeAST> ParseExtern() {
+    getNextToken();
+    return ParsePrototype();
+}
+
+//===----------------------------------------------------------------------===//
+// Module-level analysis
+//===----------------------------------------------------------------------===//
+
+/// FunctionDefs — latest definition of every named function in the module
+static std::map<std::string, std::unique_ptr<FunctionAST>> FunctionDefs;
+
+/// TopLevelExprs — anonymous functions for every top-level expression
+static std::vector<std::unique_ptr<FunctionAST>> TopLevelExprs;
+
+/// CallGraph — maps each defined function to the functions it may call
+using CallGraph = std::map<std::string, std::set<std::string>>;
+
+/// GetCalleeName — the function Expr calls, counting user-defined operators,
+/// or "" if Expr is not a call
+static std::string GetCalleeName(ExprAST &Expr) {
+    if (auto *Call = dynamic_cast<CallExprAST *>(&Expr)) {
+        return Call->getCallee();
+    }
+    if (auto *Unary = dynamic_cast<UnaryExprAST *>(&Expr)) {
+        return std::string("unary") + Unary->getOpcode();
+    }
+    if (auto *Binary = dynamic_cast<BinaryExprAST *>(&Expr)) {
+        return std::string("binary") + Binary->getOp();
+    }
+    return "";
+}
+
+/// CollectCallees — adds every function referenced by Expr to Callees,
+/// including the functions behind user-defined operators
+static void CollectCallees(ExprAST &Expr, std::set<std::string> &Callees) {
+    std::string Callee = GetCalleeName(Expr);
+    if (!Callee.empty()) {
+        Callees.insert(Callee);
+    }
+    
+    for (auto *Child : Expr.children()) {
+        CollectCallees(**Child, Callees);
+    }
+}
+
+/// BuildCallGraph — links every definition to the definitions it calls;
+/// externs and built-ins are leaves and are left out
+static CallGraph BuildCallGraph() {
+    CallGraph CG;
+    for (auto &Def : FunctionDefs) {
+        std::set<std::string> Callees;
+        CollectCallees(Def.second->getBody(), Callees);
+        
+        auto &Edges = CG[Def.first];
+        for (auto &Callee : Callees) {
+            if (FunctionDefs.count(Callee)) {
+                Edges.insert(Callee);
+            }
+        }
+    }
+    return CG;
+}
+
+namespace {
+
+/// SCCFinder — Tarjan's algorithm, which emits strongly connected components
+/// bottom-up: every SCC comes after all the SCCs it calls into
+class SCCFinder {
+    const CallGraph &CG;
+    std::map<std::string, unsigned> Index, LowLink;
+    std::vector<std::string> Stack;
+    std::set<std::string> OnStack;
+    unsigned NextIndex = 0;
+    
+public:
+    std::vector<std::vector<std::string>> SCCs;
+    
+    SCCFinder(const CallGraph &CG) : CG(CG) {}
+    
+    void visit(const std::string &Name) {
+        if (Index.count(Name)) {
+            return;
+        }
+        
+        Index[Name] = LowLink[Name] = NextIndex++;
+        Stack.push_back(Name);
+        OnStack.insert(Name);
+        
+        for (auto &Callee : CG.at(Name)) {
+            if (!Index.count(Callee)) {
+                visit(Callee);
+                LowLink[Name] = std::min(LowLink[Name], LowLink[Callee]);
+            }
+            else if (OnStack.count(Callee)) {
+                LowLink[Name] = std::min(LowLink[Name], Index[Callee]);
+            }
+        }
+        
+        // Popping a finished component once its root is reached
+        if (LowLink[Name] == Index[Name]) {
+            std::vector<std::string> SCC;
+            std::string Member;
+            do {
+                Member = Stack.back();
+                Stack.pop_back();
+                OnStack.erase(Member);
+                SCC.push_back(Member);
+            } while (Member != Name);
+            SCCs.push_back(std::move(SCC));
+        }
+    }
+};
+
+} // end anonymous namespace
+
+/// CompileOrder — definitions left after pruning, callees before callers
+static std::vector<std::string> CompileOrder;
+
+/// PruneModule — drops definitions no top-level expression can reach and
+/// reports the bottom-up order in which the remaining ones should compile
+static void PruneModule() {
+    if (FunctionDefs.empty()) {
+        return;
+    }
+    
+    CallGraph CG = BuildCallGraph();
+    
+    std::set<std::string> Roots;
+    for (auto &Expr : TopLevelExprs) {
+        CollectCallees(Expr->getBody(), Roots);
+    }
+    
+    SCCFinder Finder(CG);
+    for (auto &Root : Roots) {
+        if (CG.count(Root)) {
+            Finder.visit(Root);
+        }
+    }
+    
+    // Anything Tarjan's walk did not reach is dead
+    std::set<std::string> Reachable;
+    for (auto &SCC : Finder.SCCs) {
+        Reachable.insert(SCC.begin(), SCC.end());
+    }
+    
+    unsigned NumDefs = FunctionDefs.size();
+    for (auto I = FunctionDefs.begin(); I != FunctionDefs.end();) {
+        if (Reachable.count(I->first)) {
+            ++I;
+            continue;
+        }
+        fprintf(stderr, "Pruned unreachable function %s\n", I->first.c_str());
+        I = FunctionDefs.erase(I);
+    }
+    fprintf(stderr, "Kept %u of %u functions\n", (unsigned)FunctionDefs.size(),
+            NumDefs);
+    
+    if (Finder.SCCs.empty()) {
+        return;
+    }
+    
+    fprintf(stderr, "Compile order:");
+    for (auto &SCC : Finder.SCCs) {
+        CompileOrder.insert(CompileOrder.end(), SCC.begin(), SCC.end());
+        fprintf(stderr, SCC.size() > 1 ? " (" : " ");
+        for (unsigned i = 0, e = SCC.size(); i != e; ++i) {
+            fprintf(stderr, i ? " %s" : "%s", SCC[i].c_str());
+        }
+        fprintf(stderr, SCC.size() > 1 ? ")" : "");
+    }
+    fprintf(stderr, "\n");
+}
+
+/// FoldNode — evaluates a built-in operator or intrinsic whose operands are
+/// all literals, or picks the arm of an if with a literal condition; only
+/// folds that give the exact result the program would compute are done
+static bool FoldNode(std::unique_ptr<ExprAST> &Expr) {
+    auto Literal = [](std::unique_ptr<ExprAST> *E, double &Val) {
+        auto *Num = dynamic_cast<NumberExprAST *>(E->get());
+        if (Num) {
+            Val = Num->getVal();
+        }
+        return Num != nullptr;
+    };
+    
+    double Result;
+    auto Children = Expr->children();
+    if (dynamic_cast<IfExprAST *>(Expr.get())) {
+        double Cond;
+        if (Literal(Children[0], Cond)) {
+            // Taking the arm out before the if node is destroyed
+            auto Arm = std::move(Cond != 0.0 ? *Children[1] : *Children[2]);
+            Expr = std::move(Arm);
+            return true;
+        }
+        return false;
+    }
+    else if (auto *Binary = dynamic_cast<BinaryExprAST *>(Expr.get())) {
+        double L, R;
+        if (FunctionDefs.count(std::string("binary") + Binary->getOp()) ||
+            !Literal(Children[0], L) || !Literal(Children[1], R)) {
+            return false;
+        }
+        
+        switch (Binary->getOp()) {
+        case '+': Result = L + R; break;
+        case '-': Result = L - R; break;
+        case '*': Result = L * R; break;
+        case '/': Result = L / R; break;
+        // Comparisons are unordered: NaN operands compare true
+        case '<': Result = !(L >= R); break;
+        case '>': Result = !(L <= R); break;
+        default:
+            return false;
+        }
+    }
+    else if (auto *Call = dynamic_cast<CallExprAST *>(Expr.get())) {
+        const std::string &Callee = Call->getCallee();
+        if (!BuiltinArity.count(Callee) || FunctionDefs.count(Callee)) {
+            return false;
+        }
+        
+        std::vector<double> Args(Children.size());
+        for (unsigned i = 0, e = Children.size(); i != e; ++i) {
+            if (!Literal(Children[i], Args[i])) {
+                return false;
+            }
+        }
+        
+        // Only correctly rounded intrinsics; libm transcendentals may differ
+        if (Callee == "sqrt") {
+            Result = sqrt(Args[0]);
+        }
+        else if (Callee == "abs") {
+            Result = fabs(Args[0]);
+        }
+        else if (Callee == "floor") {
+            Result = floor(Args[0]);
+        }
+        else if (Callee == "min") {
+            Result = fmin(Args[0], Args[1]);
+        }
+        else if (Callee == "max") {
+            Result = fmax(Args[0], Args[1]);
+        }
+        else if (Callee == "fma") {
+            // Rounding the double fma to float would round twice
+            Result = SinglePrecision
+                         ? fmaf((float)Args[0], (float)Args[1], (float)Args[2])
+                         : fma(Args[0], Args[1], Args[2]);
+        }
+        else {
+            return false;
+        }
+    }
+    else {
+        return false;
+    }
+    
+    if (SinglePrecision) {
+        Result = (float)Result;
+    }
+    Expr = std::make_unique<NumberExprAST>(Result);
+    return true;
+}
+
+/// FoldConstants — folds every foldable node of Expr, innermost first;
+/// returns whether anything was folded
+static bool FoldConstants(std::unique_ptr<ExprAST> &Expr) {
+    bool Changed = false;
+    for (auto *Child : Expr->children()) {
+        Changed |= FoldConstants(*Child);
+    }
+    return FoldNode(Expr) || Changed;
+}
+
+/// IsPure — whether evaluating Expr can neither have side effects nor call
+/// into user code, so dropping or repeating the evaluation is unobservable
+static bool IsPure(ExprAST &Expr) {
+    if (auto *Binary = dynamic_cast<BinaryExprAST *>(&Expr)) {
+        if (Binary->getOp() == '=' ||
+            FunctionDefs.count(std::string("binary") + Binary->getOp())) {
+            return false;
+        }
+    }
+    else if (auto *Call = dynamic_cast<CallExprAST *>(&Expr)) {
+        if (!BuiltinArity.count(Call->getCallee()) ||
+            FunctionDefs.count(Call->getCallee())) {
+            return false;
+        }
+    }
+    else if (!dynamic_cast<NumberExprAST *>(&Expr) &&
+             !dynamic_cast<VariableExprAST *>(&Expr) &&
+             !dynamic_cast<IndexExprAST *>(&Expr) &&
+             !dynamic_cast<VectorExprAST *>(&Expr) &&
+             !dynamic_cast<IfExprAST *>(&Expr)) {
+        return false;
+    }
+    
+    for (auto *Child : Expr.children()) {
+        if (!IsPure(**Child)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// IsRebound — whether Name is assigned to or shadowed anywhere in Expr
+static bool IsRebound(ExprAST &Expr, const std::string &Name) {
+    if (auto *Binary = dynamic_cast<BinaryExprAST *>(&Expr)) {
+        auto *Dest = dynamic_cast<VariableExprAST *>(Expr.children()[0]->get());
+        if (Binary->getOp() == '=' && Dest && Dest->getName() == Name) {
+            return true;
+        }
+    }
+    else if (auto *For = dynamic_cast<ForExprAST *>(&Expr)) {
+        if (For->getVarName() == Name) {
+            return true;
+        }
+    }
+    else if (auto *Parallel = dynamic_cast<ParallelExprAST *>(&Expr)) {
+        if (Parallel->getVarName() == Name) {
+            return true;
+        }
+    }
+    else if (auto *Var = dynamic_cast<VarExprAST *>(&Expr)) {
+        if (Var->declares(Name)) {
+            return true;
+        }
+    }
+    
+    for (auto *Child : Expr.children()) {
+        if (IsRebound(**Child, Name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// ReplaceVariable — replaces every reference to Name in Expr with Val;
+/// returns whether there was any
+static bool ReplaceVariable(std::unique_ptr<ExprAST> &Expr,
+                            const std::string &Name, double Val) {
+    auto *Variable = dynamic_cast<VariableExprAST *>(Expr.get());
+    if (Variable && Variable->getName() == Name) {
+        Expr = std::make_unique<NumberExprAST>(Val);
+        return true;
+    }
+    
+    bool Replaced = false;
+    for (auto *Child : Expr->children()) {
+        Replaced |= ReplaceVariable(*Child, Name, Val);
+    }
+    return Replaced;
+}
+
+namespace {
+
+/// CallSite — a call to one function, with the slot owning the call and the
+/// slots owning its arguments; only valid until the tree is next rewritten
+struct CallSite {
+    std::string Caller;
+    std::unique_ptr<ExprAST> *Call;
+    std::vector<std::unique_ptr<ExprAST> *> Args;
+};
+
+} // end anonymous namespace
+
+/// CollectCallSites — records every call to Callee in Expr, innermost calls
+/// first so rewriting the calls in order never frees a recorded slot
+static void CollectCallSites(const std::string &Callee,
+                             const std::string &Caller,
+                             std::unique_ptr<ExprAST> &Expr,
+                             std::vector<CallSite> &Sites) {
+    for (auto *Child : Expr->children()) {
+        CollectCallSites(Callee, Caller, *Child, Sites);
+    }
+    
+    if (GetCalleeName(*Expr) == Callee) {
+        Sites.push_back(CallSite{Caller, &Expr, Expr->children()});
+    }
+}
+
+namespace {
+
+/// ConstantPropagator — interprocedural constant propagation over a
+/// worklist seeded with the bottom-up compile order: arguments that receive
+/// the same literal at every call site are substituted into the callee's
+/// body, and calls to functions that fold to a literal are replaced by it.
+/// Only the functions a rewrite can affect are revisited
+class ConstantPropagator {
+    /// CallersOf — definitions and top-level expressions calling each
+    /// function; rewrites only remove calls, so this never goes stale
+    std::map<std::string, std::vector<FunctionAST *>> CallersOf;
+    std::map<std::string, std::set<unsigned>> Propagated;
+    std::deque<std::string> Worklist;
+    std::set<std::string> Queued;
+    
+    void enqueue(const std::string &Name) {
+        if (FunctionDefs.count(Name) && Queued.insert(Name).second) {
+            Worklist.push_back(Name);
+        }
+    }
+    
+    /// changed — folds a rewritten function and revisits it and every
+    /// function it calls, whose call sites may now pass literals
+    void changed(FunctionAST &FnAST) {
+        FoldConstants(FnAST.getBodySlot());
+        enqueue(FnAST.getProto().getName());
+        
+        std::set<std::string> Callees;
+        CollectCallees(FnAST.getBody(), Callees);
+        for (auto &Callee : Callees) {
+            enqueue(Callee);
+        }
+    }
+    
+    /// collectSites — every call to Name in the module, or false if any of
+    /// them passes the wrong number of arguments
+    bool collectSites(const std::string &Name, std::vector<CallSite> &Sites) {
+        for (auto *Caller : CallersOf[Name]) {
+            CollectCallSites(Name, Caller->getProto().getName(),
+                             Caller->getBodySlot(), Sites);
+        }
+        
+        size_t NumArgs = FunctionDefs[Name]->getProto().getArgs().size();
+        for (auto &Site : Sites) {
+            if (Site.Args.size() != NumArgs) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    void propagateArguments(const std::string &Name);
+    void propagateReturnValue(const std::string &Name);
+    
+public:
+    bool Changed = false;
+    
+    ConstantPropagator() {
+        auto AddCaller = [this](FunctionAST &Caller) {
+            std::set<std::string> Callees;
+            CollectCallees(Caller.getBody(), Callees);
+            for (auto &Callee : Callees) {
+                if (FunctionDefs.count(Callee)) {
+                    CallersOf[Callee].push_back(&Caller);
+                }
+            }
+        };
+        for (auto &Def : FunctionDefs) {
+            AddCaller(*Def.second);
+        }
+        for (auto &Expr : TopLevelExprs) {
+            AddCaller(*Expr);
+        }
+    }
+    
+    void run() {
+        for (auto &Name : CompileOrder) {
+            enqueue(Name);
+        }
+        
+        while (!Worklist.empty()) {
+            std::string Name = Worklist.front();
+            Worklist.pop_front();
+            Queued.erase(Name);
+            
+            // Folding can drop calls, which may leave the callees' remaining
+            // call sites all passing the same literal
+            auto &FnAST = *FunctionDefs[Name];
+            if (FoldConstants(FnAST.getBodySlot())) {
+                changed(FnAST);
+            }
+            
+            propagateArguments(Name);
+            propagateReturnValue(Name);
+        }
+    }
+};
+
+} // end anonymous namespace
+
+void ConstantPropagator::propagateArguments(const std::string &Name) {
+    auto &FnAST = *FunctionDefs[Name];
+    auto &Proto = FnAST.getProto();
+    auto &Args = Proto.getArgs();
+    
+    // Deciding every argument before the body is rewritten under the sites
+    std::vector<std::pair<unsigned, double>> Constants;
+    std::vector<CallSite> Sites;
+    if (!collectSites(Name, Sites) || Sites.empty()) {
+        return;
+    }
+    
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+        if (Proto.isArrayArg(i) || Propagated[Name].count(i) ||
+            IsRebound(FnAST.getBody(), Args[i])) {
+            continue;
+        }
+        
+        bool IsConstant = true;
+        bool HasValue = false;
+        double Val = 0;
+        for (auto &Site : Sites) {
+            auto *Arg = Site.Args[i]->get();
+            
+            // Recursive calls passing the parameter through agree
+            auto *Variable = dynamic_cast<VariableExprAST *>(Arg);
+            if (Site.Caller == Name && Variable && Variable->getName() == Args[i]) {
+                continue;
+            }
+            
+            auto *Num = dynamic_cast<NumberExprAST *>(Arg);
+            if (!Num || (HasValue && Num->getVal() != Val)) {
+                IsConstant = false;
+                break;
+            }
+            HasValue = true;
+            Val = Num->getVal();
+        }
+        if (IsConstant && HasValue) {
+            Constants.push_back(std::make_pair(i, Val));
+        }
+    }
+    Sites.clear();
+    
+    if (Constants.empty()) {
+        return;
+    }
+    
+    // An argument the body never reads is settled too, but changes nothing
+    bool Replaced = false;
+    for (auto &Constant : Constants) {
+        Propagated[Name].insert(Constant.first);
+        if (!ReplaceVariable(FnAST.getBodySlot(), Args[Constant.first],
+                             Constant.second)) {
+            continue;
+        }
+        fprintf(stderr, "Propagated constant %.17g into %s(%s)\n", Constant.second,
+                Name.c_str(), Args[Constant.first].c_str());
+        Replaced = true;
+    }
+    if (!Replaced) {
+        return;
+    }
+    Changed = true;
+    changed(FnAST);
+}
+
+void ConstantPropagator::propagateReturnValue(const std::string &Name) {
+    auto *Num = dynamic_cast<NumberExprAST *>(&FunctionDefs[Name]->getBody());
+    if (!Num) {
+        return;
+    }
+    double Val = Num->getVal();
+    
+    // Callers are rewritten one at a time, each with freshly collected sites
+    unsigned NumReplaced = 0;
+    size_t NumArgs = FunctionDefs[Name]->getProto().getArgs().size();
+    for (auto *Caller : CallersOf[Name]) {
+        std::vector<CallSite> Sites;
+        CollectCallSites(Name, Caller->getProto().getName(), Caller->getBodySlot(),
+                         Sites);
+        
+        unsigned NumReplacedInCaller = 0;
+        for (auto &Site : Sites) {
+            bool Replaceable = Site.Args.size() == NumArgs;
+            for (auto *Arg : Site.Args) {
+                Replaceable &= IsPure(**Arg);
+            }
+            if (Replaceable) {
+                *Site.Call = std::make_unique<NumberExprAST>(Val);
+                ++NumReplacedInCaller;
+            }
+        }
+        Sites.clear();
+        
+        if (NumReplacedInCaller) {
+            NumReplaced += NumReplacedInCaller;
+            changed(*Caller);
+        }
+    }
+    
+    if (NumReplaced) {
+        fprintf(stderr, "Replaced %u calls to %s with constant %.17g\n", NumReplaced,
+                Name.c_str(), Val);
+        Changed = true;
+    }
+}
+
+/// PropagateConstants — runs interprocedural constant propagation over the
+/// module left after pruning
+static void PropagateConstants() {
+    for (auto &Expr : TopLevelExprs) {
+        FoldConstants(Expr->getBodySlot());
+    }
+    
+    ConstantPropagator Propagator;
+    Propagator.run();
+    
+    if (DumpAST && Propagator.Changed) {
+        for (auto &Def : FunctionDefs) {
+            Def.second->dump();
+        }
+        for (auto &Expr : TopLevelExprs) {
+            Expr->dump();
+        }
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Algebraic simplification
+//===----------------------------------------------------------------------===//
+
+/// SimplifyNodeBudget — node visits one function may spend reaching a
+/// fixed point, so pathological inputs cannot stall the REPL
+static const unsigned SimplifyNodeBudget = 100000;
+
+/// CountNodes — number of expression nodes in Expr
+static unsigned CountNodes(ExprAST &Expr) {
+    unsigned Count = 1;
+    for (auto *Child : Expr.children()) {
+        Count += CountNodes(**Child);
+    }
+    return Count;
+}
+
+/// IsSameExpr — whether A and B are structurally identical expressions;
+/// anything that binds names is conservatively treated as different
+static bool IsSameExpr(ExprAST &A, ExprAST &B) {
+    if (typeid(A) != typeid(B)) {
+        return false;
+    }
+    
+    if (auto *Num = dynamic_cast<NumberExprAST *>(&A)) {
+        double Val = static_cast<NumberExprAST &>(B).getVal();
+        if (Num->getVal() != Val || std::signbit(Num->getVal()) != std::signbit(Val)) {
+            return false;
+        }
+    }
+    else if (auto *Variable = dynamic_cast<VariableExprAST *>(&A)) {
+        if (Variable->getName() != static_cast<VariableExprAST &>(B).getName()) {
+            return false;
+        }
+    }
+    else if (auto *Binary = dynamic_cast<BinaryExprAST *>(&A)) {
+        if (Binary->getOp() != static_cast<BinaryExprAST &>(B).getOp()) {
+            return false;
+        }
+    }
+    else if (auto *Unary = dynamic_cast<UnaryExprAST *>(&A)) {
+        if (Unary->getOpcode() != static_cast<UnaryExprAST &>(B).getOpcode()) {
+            return false;
+        }
+    }
+    else if (auto *Call = dynamic_cast<CallExprAST *>(&A)) {
+        if (Call->getCallee() != static_cast<CallExprAST &>(B).getCallee()) {
+            return false;
+        }
+    }
+    else if (!dynamic_cast<IfExprAST *>(&A) && !dynamic_cast<VectorExprAST *>(&A)) {
+        return false;
+    }
+    
+    auto AChildren = A.children();
+    auto BChildren = B.children();
+    if (AChildren.size() != BChildren.size()) {
+        return false;
+    }
+    for (unsigned i = 0, e = AChildren.size(); i != e; ++i) {
+        if (!IsSameExpr(**AChildren[i], **BChildren[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// IsLiteral — whether Expr is the literal Val, telling +0 and -0 apart
+static bool IsLiteral(std::unique_ptr<ExprAST> &Expr, double Val) {
+    auto *Num = dynamic_cast<NumberExprAST *>(Expr.get());
+    return Num && Num->getVal() == Val &&
+           std::signbit(Num->getVal()) == std::signbit(Val);
+}
+
+/// AsBuiltinBinary — Expr as a binary operator with one of the built-in
+/// meanings, or null if it is anything else or a user-defined operator
+static BinaryExprAST *AsBuiltinBinary(ExprAST &Expr) {
+    auto *Binary = dynamic_cast<BinaryExprAST *>(&Expr);
+    if (!Binary || Binary->getOp() == '=' ||
+        FunctionDefs.count(std::string("binary") + Binary->getOp())) {
+        return nullptr;
+    }
+    return Binary;
+}
+
+/// SimplifyNode — applies the first matching rewrite rule to Expr. The IEEE
+/// rules hold for every input including NaN, infinities and signed zeros;
+/// the others are only used when the fast-math flags allow them
+static bool SimplifyNode(std::unique_ptr<ExprAST> &Expr) {
+    if (FoldNode(Expr)) {
+        return true;
+    }
+    
+    auto *Binary = AsBuiltinBinary(*Expr);
+    if (!Binary) {
+        return false;
+    }
+    
+    char Op = Binary->getOp();
+    auto Children = Expr->children();
+    auto &L = *Children[0];
+    auto &R = *Children[1];
+    
+    // Reassociation implies signed zeros may be ignored, as in GCC
+    bool NoSignedZeros = FastMath.AllowReassoc;
+    bool Finite = FastMath.NoNaNs && FastMath.NoInfs;
+    
+    std::unique_ptr<ExprAST> Result;
+    switch (Op) {
+    case '*':
+        if (IsLiteral(R, 1.0)) {
+            Result = std::move(L); // x * 1 -> x
+        }
+        else if (IsLiteral(L, 1.0)) {
+            Result = std::move(R); // 1 * x -> x
+        }
+        else if (Finite && NoSignedZeros && IsLiteral(R, 0.0) && IsPure(*L)) {
+            Result = std::move(R); // x * 0 -> 0
+        }
+        else if (Finite && NoSignedZeros && IsLiteral(L, 0.0) && IsPure(*R)) {
+            Result = std::move(L); // 0 * x -> 0
+        }
+        break;
+    case '/':
+        if (IsLiteral(R, 1.0)) {
+            Result = std::move(L); // x / 1 -> x
+        }
+        else if (Finite && IsPure(*L) && IsSameExpr(*L, *R)) {
+            Result = std::make_unique<NumberExprAST>(1.0); // x / x -> 1
+        }
+        break;
+    case '+':
+        if (IsLiteral(R, -0.0) || (NoSignedZeros && IsLiteral(R, 0.0))) {
+            Result = std::move(L); // x + -0 -> x
+        }
+        else if (IsLiteral(L, -0.0) || (NoSignedZeros && IsLiteral(L, 0.0))) {
+            Result = std::move(R); // -0 + x -> x
+        }
+        break;
+    case '-':
+        if (IsLiteral(R, 0.0) || (NoSignedZeros && IsLiteral(R, -0.0))) {
+            Result = std::move(L); // x - 0 -> x
+        }
+        else if (Finite && IsPure(*L) && IsSameExpr(*L, *R)) {
+            Result = std::make_unique<NumberExprAST>(0.0); // x - x -> 0
+        }
+        break;
+    }
+    if (Result) {
+        Expr = std::move(Result);
+        return true;
+    }
+    
+    if (!FastMath.AllowReassoc) {
+        return false;
+    }
+    
+    // (x op c1) op c2 -> x op (c1 op c2), for op in + and *
+    auto *Inner = AsBuiltinBinary(*L);
+    if ((Op == '+' || Op == '*') && Inner && Inner->getOp() == Op &&
+        dynamic_cast<NumberExprAST *>(R.get())) {
+        auto InnerChildren = L->children();
+        if (dynamic_cast<NumberExprAST *>(InnerChildren[1]->get())) {
+            std::unique_ptr<ExprAST> Constant = std::make_unique<BinaryExprAST>(
+                Op, std::move(*InnerChildren[1]), std::move(R));
+            FoldNode(Constant);
+            Expr = std::make_unique<BinaryExprAST>(
+                Op, std::move(*InnerChildren[0]), std::move(Constant));
+            return true;
+        }
+    }
+    
+    // (a * c) +- (b * c) -> (a +- b) * c; c is read once instead of twice,
+    // so none of the factors may assign to it
+    auto *LMul = AsBuiltinBinary(*L);
+    auto *RMul = AsBuiltinBinary(*R);
+    if ((Op == '+' || Op == '-') && LMul && RMul && LMul->getOp() == '*' &&
+        RMul->getOp() == '*' && IsPure(*L) && IsPure(*R)) {
+        auto LFactors = L->children();
+        auto RFactors = R->children();
+        for (unsigned i = 0; i != 2; ++i) {
+            for (unsigned j = 0; j != 2; ++j) {
+                if (!IsSameExpr(**LFactors[i], **RFactors[j])) {
+                    continue;
+                }
+                auto Sum = std::make_unique<BinaryExprAST>(
+                    Op, std::move(*LFactors[1 - i]), std::move(*RFactors[1 - j]));
+                Expr = std::make_unique<BinaryExprAST>('*', std::move(Sum),
+                                                       std::move(*LFactors[i]));
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/// SimplifyExpr — one bottom-up rewriting sweep over Expr, charging every
+/// visited node to Budget
+static bool SimplifyExpr(std::unique_ptr<ExprAST> &Expr, unsigned &Budget) {
+    if (!Budget) {
+        return false;
+    }
+    --Budget;
+    
+    bool Changed = false;
+    for (auto *Child : Expr->children()) {
+        Changed |= SimplifyExpr(*Child, Budget);
+    }
+    
+    // Rewriting this node until no rule applies
+    while (Budget && SimplifyNode(Expr)) {
+        --Budget;
+        Changed = true;
+    }
+    return Changed;
+}
+
+/// SimplifyToFixedPoint — rewrites Expr until no rule applies, or until the
+/// node budget runs out
+static void SimplifyToFixedPoint(std::unique_ptr<ExprAST> &Expr) {
+    unsigned Budget = SimplifyNodeBudget;
+    while (SimplifyExpr(Expr, Budget)) {
+    }
+}
+
+/// SimplifyFunction — simplifies the body of FnAST and reports the reduction
+/// in node count
+static void SimplifyFunction(FunctionAST &FnAST) {
+    unsigned Before = CountNodes(FnAST.getBody());
+    
+    SimplifyToFixedPoint(FnAST.getBodySlot());
+    
+    unsigned After = CountNodes(FnAST.getBody());
+    if (After != Before) {
+        fprintf(stderr, "Simplified %s from %u to %u nodes\n",
+                FnAST.getProto().getName().c_str(), Before, After);
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Strength reduction
+//===----------------------------------------------------------------------===//
+
+/// NextTempId — numbers the temporaries that passes introduce; their names
+/// contain a '.', so they can never clash with a user identifier
+static unsigned NextTempId = 0;
+
+static std::string MakeTempName(const char *Prefix) {
+    return std::string(Prefix) + "." + std::to_string(NextTempId++);
+}
+
+/// CollectOperands — flattens a chain of the built-in operator Op into the
+/// slots of its operands; unless AnyShape is set only the left spine is
+/// followed, which is the shape ParseBinOpRHS() builds for 'a * b * c'
+static void CollectOperands(std::unique_ptr<ExprAST> &Expr, char Op,
+                            bool AnyShape,
+                            std::vector<std::unique_ptr<ExprAST> *> &Operands) {
+    auto *Binary = AsBuiltinBinary(*Expr);
+    if (!Binary || Binary->getOp() != Op) {
+        Operands.push_back(&Expr);
+        return;
+    }
+    
+    auto Children = Expr->children();
+    CollectOperands(*Children[0], Op, AnyShape, Operands);
+    if (AnyShape) {
+        CollectOperands(*Children[1], Op, AnyShape, Operands);
+    }
+    else {
+        Operands.push_back(Children[1]);
+    }
+}
+
+/// BuildBalancedTree — combines Terms pairwise with Op, so the result is
+/// only log2(N) operations deep instead of N - 1
+static std::unique_ptr<ExprAST>
+BuildBalancedTree(char Op, std::vector<std::unique_ptr<ExprAST>> Terms) {
+    while (Terms.size() > 1) {
+        std::vector<std::unique_ptr<ExprAST>> Next;
+        for (unsigned i = 0; i + 1 < Terms.size(); i += 2) {
+            Next.push_back(std::make_unique<BinaryExprAST>(
+                Op, std::move(Terms[i]), std::move(Terms[i + 1])));
+        }
+        if (Terms.size() % 2) {
+            Next.push_back(std::move(Terms.back()));
+        }
+        Terms = std::move(Next);
+    }
+    return std::move(Terms[0]);
+}
+
+using Bindings = std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>>;
+
+/// BuildPower — Base^N by repeated squaring: the squares are appended to
+/// Binds and the ones N needs are multiplied together; the highest square
+/// is used once, so it is not bound
+static std::unique_ptr<ExprAST> BuildPower(const std::string &Base, unsigned N,
+                                           Bindings &Binds) {
+    std::vector<std::unique_ptr<ExprAST>> Terms;
+    std::string Square = Base;
+    while (true) {
+        if (N & 1) {
+            Terms.push_back(std::make_unique<VariableExprAST>(Square));
+        }
+        N >>= 1;
+        if (!N) {
+            break;
+        }
+        
+        auto Squared = std::make_unique<BinaryExprAST>(
+            '*', std::make_unique<VariableExprAST>(Square),
+            std::make_unique<VariableExprAST>(Square));
+        if (N == 1) {
+            Terms.push_back(std::move(Squared));
+            break;
+        }
+        
+        std::string Next = MakeTempName("sq");
+        Binds.push_back(std::make_pair(Next, std::move(Squared)));
+        Square = Next;
+    }
+    return BuildBalancedTree('*', std::move(Terms));
+}
+
+/// ReduceStrength — rewrites multiply chains with repeated pure factors.
+/// With reassociation allowed, x * x * x * x * x * x becomes a squaring tree
+/// three multiplies deep; otherwise the chain keeps its shape and rounding,
+/// and a repeated non-trivial factor is only bound to a temporary once
+static void ReduceStrength(std::unique_ptr<ExprAST> &Expr, unsigned &NumReduced) {
+    auto *Binary = AsBuiltinBinary(*Expr);
+    if (!Binary || Binary->getOp() != '*') {
+        for (auto *Child : Expr->children()) {
+            ReduceStrength(*Child, NumReduced);
+        }
+        return;
+    }
+    
+    bool AnyShape = FastMath.AllowReassoc;
+    std::vector<std::unique_ptr<ExprAST> *> Factors;
+    CollectOperands(Expr, '*', AnyShape, Factors);
+    for (auto *Factor : Factors) {
+        ReduceStrength(*Factor, NumReduced);
+    }
+    
+    // Grouping moves reads of a variable across the other factors, so a
+    // factor that may assign to it rules out grouping in the whole chain
+    for (auto *Factor : Factors) {
+        if (!IsPure(**Factor)) {
+            return;
+        }
+    }
+    
+    // Grouping identical factors
+    std::vector<std::pair<std::unique_ptr<ExprAST> *, unsigned>> Groups;
+    for (auto *Factor : Factors) {
+        bool Merged = false;
+        for (auto &Group : Groups) {
+            if (IsSameExpr(**Group.first, **Factor)) {
+                ++Group.second;
+                Merged = true;
+                break;
+            }
+        }
+        if (!Merged) {
+            Groups.push_back(std::make_pair(Factor, 1u));
+        }
     }
-    if (CurTok != ')') {
-        return LogErrorP("expected ')' in prototype");
+    
+    // Only worth it if a squaring saves a multiply or a factor is recomputed
+    bool Profitable = false;
+    for (auto &Group : Groups) {
+        bool Trivial = dynamic_cast<VariableExprAST *>(Group.first->get()) ||
+                       dynamic_cast<NumberExprAST *>(Group.first->get());
+        Profitable |= Group.second >= 3 || (Group.second == 2 && !Trivial);
+    }
+    if (!Profitable) {
+        return;
     }
     
-    getNextToken();
+    if (!AnyShape) {
+        auto &Base = *Groups[0].first;
+        if (Groups.size() != 1 || dynamic_cast<VariableExprAST *>(Base.get()) ||
+            dynamic_cast<NumberExprAST *>(Base.get())) {
+            return;
+        }
+        
+        Bindings Binds;
+        std::string Name = MakeTempName("pow");
+        Binds.push_back(std::make_pair(Name, std::move(Base)));
+        for (auto *Factor : Factors) {
+            *Factor = std::make_unique<VariableExprAST>(Name);
+        }
+        Expr = std::make_unique<VarExprAST>(std::move(Binds), std::move(Expr));
+        ++NumReduced;
+        return;
+    }
+    
+    Bindings Binds;
+    std::vector<std::unique_ptr<ExprAST>> Terms;
+    for (auto &Group : Groups) {
+        auto &Factor = *Group.first;
+        if (Group.second == 1) {
+            Terms.push_back(std::move(Factor));
+            continue;
+        }
+        
+        std::string Base;
+        if (auto *Variable = dynamic_cast<VariableExprAST *>(Factor.get())) {
+            Base = Variable->getName();
+        }
+        else {
+            Base = MakeTempName("pow");
+            Binds.push_back(std::make_pair(Base, std::move(Factor)));
+        }
+        Terms.push_back(BuildPower(Base, Group.second, Binds));
+    }
     
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+    auto Product = BuildBalancedTree('*', std::move(Terms));
+    if (Binds.empty()) {
+        Expr = std::move(Product);
+    }
+    else {
+        Expr = std::make_unique<VarExprAST>(std::move(Binds), std::move(Product));
+    }
+    ++NumReduced;
 }
 
-/// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-    getNextToken();
-    auto Proto = ParsePrototype();
-    if (!Proto) {
-        return nullptr;
+/// ReduceStrengthInFunction — runs ReduceStrength over the body of FnAST
+static void ReduceStrengthInFunction(FunctionAST &FnAST) {
+    unsigned NumReduced = 0;
+    ReduceStrength(FnAST.getBodySlot(), NumReduced);
+    if (NumReduced) {
+        fprintf(stderr, "Reduced %u multiply chains in %s\n", NumReduced,
+                FnAST.getProto().getName().c_str());
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Tree rebalancing
+//===----------------------------------------------------------------------===//
+
+/// ChainDepth — number of Op operations on the longest path through the
+/// chain of built-in Op operators rooted at Expr
+static unsigned ChainDepth(ExprAST &Expr, char Op) {
+    auto *Binary = AsBuiltinBinary(Expr);
+    if (!Binary || Binary->getOp() != Op) {
+        return 0;
     }
     
-    if (auto E = ParseExpression()) {
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    unsigned Depth = 0;
+    for (auto *Child : Expr.children()) {
+        Depth = std::max(Depth, ChainDepth(**Child, Op));
     }
-    return nullptr;
+    return Depth + 1;
 }
 
-/// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()) {
-        // Making anonymous proto
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
-                                                    std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+/// RebalanceChains — turns long '+' and '*' chains, which ParseBinOpRHS()
+/// builds left-deep, into balanced trees whose operations can overlap in
+/// the pipeline; without reassociation the chains are only reported
+static void RebalanceChains(std::unique_ptr<ExprAST> &Expr,
+                            const std::string &FnName, unsigned &NumRebalanced) {
+    auto *Binary = AsBuiltinBinary(*Expr);
+    if (!Binary || (Binary->getOp() != '+' && Binary->getOp() != '*')) {
+        for (auto *Child : Expr->children()) {
+            RebalanceChains(*Child, FnName, NumRebalanced);
+        }
+        return;
     }
-    return nullptr;
+    
+    char Op = Binary->getOp();
+    std::vector<std::unique_ptr<ExprAST> *> Operands;
+    CollectOperands(Expr, Op, true, Operands);
+    for (auto *Operand : Operands) {
+        RebalanceChains(*Operand, FnName, NumRebalanced);
+    }
+    
+    unsigned Depth = ChainDepth(*Expr, Op);
+    unsigned BalancedDepth = 0;
+    while ((1u << BalancedDepth) < Operands.size()) {
+        ++BalancedDepth;
+    }
+    if (Depth <= BalancedDepth) {
+        return;
+    }
+    
+    if (!FastMath.AllowReassoc) {
+        fprintf(stderr,
+                "Note: %u-term '%c' chain in %s is %u deep; --reassoc would "
+                "make it %u\n",
+                (unsigned)Operands.size(), Op, FnName.c_str(), Depth,
+                BalancedDepth);
+        return;
+    }
+    
+    std::vector<std::unique_ptr<ExprAST>> Terms;
+    for (auto *Operand : Operands) {
+        Terms.push_back(std::move(*Operand));
+    }
+    Expr = BuildBalancedTree(Op, std::move(Terms));
+    ++NumRebalanced;
 }
 
-/// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-    getNextToken();
-    return ParsePrototype();
+/// RebalanceFunction — runs RebalanceChains over the body of FnAST and then
+/// simplifies it again to fold the constants it brings together
+static void RebalanceFunction(FunctionAST &FnAST) {
+    unsigned NumRebalanced = 0;
+    const std::string &Name = FnAST.getProto().getName();
+    RebalanceChains(FnAST.getBodySlot(), Name, NumRebalanced);
+    if (NumRebalanced) {
+        fprintf(stderr, "Rebalanced %u operator chains in %s\n", NumRebalanced,
+                Name.c_str());
+        
+        // Rebalancing can pair up constants the simplifier saw apart
+        SimplifyToFixedPoint(FnAST.getBodySlot());
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Floating-point contraction
+//===----------------------------------------------------------------------===//
+
+/// ContractMultiplyAdds — a * b + c -> fma(a, b, c), rounding once instead
+/// of twice, bottom-up over Expr; c + a * b evaluates c first, so it is only
+/// contracted when nothing can observe the change in order
+static void ContractMultiplyAdds(std::unique_ptr<ExprAST> &Expr,
+                                 unsigned &NumContracted) {
+    for (auto *Child : Expr->children()) {
+        ContractMultiplyAdds(*Child, NumContracted);
+    }
+    
+    auto *Binary = AsBuiltinBinary(*Expr);
+    if (!Binary || Binary->getOp() != '+') {
+        return;
+    }
+    
+    auto Children = Expr->children();
+    auto &L = *Children[0];
+    auto &R = *Children[1];
+    auto *LMul = AsBuiltinBinary(*L);
+    auto *RMul = AsBuiltinBinary(*R);
+    bool LIsMul = LMul && LMul->getOp() == '*';
+    bool RIsMul = RMul && RMul->getOp() == '*';
+    if (!LIsMul && !(RIsMul && IsPure(*L) && IsPure(*R))) {
+        return;
+    }
+    
+    auto &Product = LIsMul ? L : R;
+    auto &Addend = LIsMul ? R : L;
+    auto Factors = Product->children();
+    std::vector<std::unique_ptr<ExprAST>> Args;
+    Args.push_back(std::move(*Factors[0]));
+    Args.push_back(std::move(*Factors[1]));
+    Args.push_back(std::move(Addend));
+    Expr = std::make_unique<CallExprAST>("fma", std::move(Args));
+    ++NumContracted;
+}
+
+/// ContractFunction — contracts the multiply-adds of FnAST when
+/// --fp-contract allows it. This runs after the other passes, so the fma
+/// calls neither hide products from factoring nor serialize the sums that
+/// rebalancing has split
+static void ContractFunction(FunctionAST &FnAST) {
+    if (!FastMath.AllowContract) {
+        return;
+    }
+    
+    unsigned NumContracted = 0;
+    ContractMultiplyAdds(FnAST.getBodySlot(), NumContracted);
+    if (NumContracted) {
+        fprintf(stderr, "Contracted %u multiply-adds in %s\n", NumContracted,
+                FnAST.getProto().getName().c_str());
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Automatic differentiation
+//===----------------------------------------------------------------------===//
+
+/// DerivativeNames — the generated partial derivative of each function with
+/// respect to each of its arguments, named d<function>d<argument>
+static std::map<std::pair<std::string, unsigned>, std::string> DerivativeNames;
+
+/// NewDerivatives — derivatives generated for the current 'grad' request,
+/// dropped again if any part of the request fails
+static std::vector<std::pair<std::string, unsigned>> NewDerivatives;
+
+/// MakeBinary — builds L op R, skipping the additions of zero and
+/// multiplications by zero or one that the differentiation rules introduce
+static std::unique_ptr<ExprAST> MakeBinary(char Op, std::unique_ptr<ExprAST> L,
+                                           std::unique_ptr<ExprAST> R) {
+    bool LZero = IsLiteral(L, 0.0), RZero = IsLiteral(R, 0.0);
+    if ((Op == '+' && LZero) || (Op == '*' && IsLiteral(L, 1.0))) {
+        return R;
+    }
+    if ((Op == '+' || Op == '-') && RZero) {
+        return L;
+    }
+    if ((Op == '*' || Op == '/') && IsLiteral(R, 1.0)) {
+        return L;
+    }
+    if ((Op == '*' && (LZero || RZero)) || (Op == '/' && LZero)) {
+        return std::make_unique<NumberExprAST>(0.0);
+    }
+    return std::make_unique<BinaryExprAST>(Op, std::move(L), std::move(R));
+}
+
+/// MakeIf — builds an if, or just the arm when both arms are the same
+/// literal and the condition can be dropped
+static std::unique_ptr<ExprAST> MakeIf(std::unique_ptr<ExprAST> Cond,
+                                       std::unique_ptr<ExprAST> Then,
+                                       std::unique_ptr<ExprAST> Else) {
+    if (dynamic_cast<NumberExprAST *>(Then.get()) && IsSameExpr(*Then, *Else) &&
+        IsPure(*Cond)) {
+        return Then;
+    }
+    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
+                                       std::move(Else));
+}
+
+static std::string DeriveFunction(const std::string &Fn, unsigned Idx);
+
+/// LocalDerivatives — the derivative of each 'var' bound name in scope
+using LocalDerivatives = std::map<std::string, std::unique_ptr<ExprAST>>;
+
+static std::unique_ptr<ExprAST> Differentiate(ExprAST &Expr,
+                                              const PrototypeAST &Proto,
+                                              const std::string &Arg,
+                                              const LocalDerivatives &Locals);
+
+/// DifferentiateCall — chain rule for Fn(Args): the sum over every argument
+/// of the partial derivative of Fn times the derivative of that argument
+static std::unique_ptr<ExprAST>
+DifferentiateCall(const std::string &Fn,
+                  const std::vector<std::unique_ptr<ExprAST> *> &Args,
+                  const PrototypeAST &Proto, const std::string &Arg,
+                  const LocalDerivatives &Locals) {
+    // Each argument is paired with the partial derivative for its position
+    auto Def = FunctionDefs.find(Fn);
+    if (Def != FunctionDefs.end() &&
+        Def->second->getProto().getArgs().size() != Args.size()) {
+        return LogError("incorrect number of arguments passed to function");
+    }
+    
+    std::unique_ptr<ExprAST> Result = std::make_unique<NumberExprAST>(0.0);
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+        auto DArg = Differentiate(**Args[i], Proto, Arg, Locals);
+        if (!DArg) {
+            return nullptr;
+        }
+        if (IsLiteral(DArg, 0.0)) {
+            continue;
+        }
+        
+        std::string Partial = DeriveFunction(Fn, i);
+        if (Partial.empty()) {
+            return nullptr;
+        }
+        
+        std::vector<std::unique_ptr<ExprAST>> ArgsCopy;
+        for (auto *CallArg : Args) {
+            ArgsCopy.push_back((*CallArg)->clone());
+        }
+        auto Term = MakeBinary(
+            '*', std::make_unique<CallExprAST>(Partial, std::move(ArgsCopy)),
+            std::move(DArg));
+        Result = MakeBinary('+', std::move(Result), std::move(Term));
+    }
+    return Result;
+}
+
+/// DifferentiateBuiltin — derivative of a call to a built-in intrinsic,
+/// given its operands and their derivatives
+static std::unique_ptr<ExprAST>
+DifferentiateBuiltin(const std::string &Callee,
+                     std::vector<std::unique_ptr<ExprAST> *> Args,
+                     std::vector<std::unique_ptr<ExprAST>> DArgs) {
+    auto Intrinsic = [&](const char *Name) {
+        std::vector<std::unique_ptr<ExprAST>> CallArgs;
+        CallArgs.push_back((*Args[0])->clone());
+        return std::make_unique<CallExprAST>(Name, std::move(CallArgs));
+    };
+    auto Zero = [] { return std::make_unique<NumberExprAST>(0.0); };
+    
+    if (Callee == "sin") {
+        return MakeBinary('*', Intrinsic("cos"), std::move(DArgs[0]));
+    }
+    if (Callee == "cos") {
+        return MakeBinary('*', MakeBinary('-', Zero(), Intrinsic("sin")),
+                          std::move(DArgs[0]));
+    }
+    if (Callee == "exp") {
+        return MakeBinary('*', Intrinsic("exp"), std::move(DArgs[0]));
+    }
+    if (Callee == "log") {
+        return MakeBinary('/', std::move(DArgs[0]), (*Args[0])->clone());
+    }
+    if (Callee == "sqrt") {
+        return MakeBinary('/', std::move(DArgs[0]),
+                          MakeBinary('*', std::make_unique<NumberExprAST>(2.0),
+                                     Intrinsic("sqrt")));
+    }
+    if (Callee == "floor") {
+        return Zero();
+    }
+    if (Callee == "abs") {
+        auto Negated = MakeBinary('-', Zero(), DArgs[0]->clone());
+        return MakeIf(
+            std::make_unique<BinaryExprAST>('<', (*Args[0])->clone(), Zero()),
+            std::move(Negated), std::move(DArgs[0]));
+    }
+    if (Callee == "fma") {
+        return MakeBinary(
+            '+',
+            MakeBinary('+', MakeBinary('*', std::move(DArgs[0]), (*Args[1])->clone()),
+                       MakeBinary('*', (*Args[0])->clone(), std::move(DArgs[1]))),
+            std::move(DArgs[2]));
+    }
+    if (Callee == "min" || Callee == "max") {
+        return MakeIf(
+            std::make_unique<BinaryExprAST>(Callee == "min" ? '<' : '>',
+                                            (*Args[0])->clone(),
+                                            (*Args[1])->clone()),
+            std::move(DArgs[0]), std::move(DArgs[1]));
+    }
+    return LogError("cannot differentiate vector or array built-ins");
+}
+
+/// Differentiate — forward-mode derivative of Expr with respect to the
+/// argument Arg of the function described by Proto, given the derivatives
+/// Locals of the 'var' bound names in scope
+static std::unique_ptr<ExprAST> Differentiate(ExprAST &Expr,
+                                              const PrototypeAST &Proto,
+                                              const std::string &Arg,
+                                              const LocalDerivatives &Locals) {
+    if (dynamic_cast<NumberExprAST *>(&Expr) || dynamic_cast<IndexExprAST *>(&Expr)) {
+        // Array elements never depend on a scalar argument
+        return std::make_unique<NumberExprAST>(0.0);
+    }
+    
+    if (auto *Variable = dynamic_cast<VariableExprAST *>(&Expr)) {
+        auto Local = Locals.find(Variable->getName());
+        if (Local != Locals.end()) {
+            return Local->second->clone();
+        }
+        
+        auto &Args = Proto.getArgs();
+        if (std::find(Args.begin(), Args.end(), Variable->getName()) == Args.end()) {
+            return LogError("cannot differentiate through local variables");
+        }
+        return std::make_unique<NumberExprAST>(Variable->getName() == Arg ? 1.0 : 0.0);
+    }
+    
+    auto Children = Expr.children();
+    if (auto *Binary = dynamic_cast<BinaryExprAST *>(&Expr)) {
+        char Op = Binary->getOp();
+        if (Op == '=') {
+            return LogError("cannot differentiate through assignments");
+        }
+        if (!AsBuiltinBinary(Expr)) {
+            return DifferentiateCall(std::string("binary") + Op, Children, Proto,
+                                     Arg, Locals);
+        }
+        
+        // Comparisons are piecewise constant
+        if (Op == '<' || Op == '>') {
+            return std::make_unique<NumberExprAST>(0.0);
+        }
+        
+        auto DL = Differentiate(**Children[0], Proto, Arg, Locals);
+        auto DR = Differentiate(**Children[1], Proto, Arg, Locals);
+        if (!DL || !DR) {
+            return nullptr;
+        }
+        
+        auto &L = *Children[0];
+        auto &R = *Children[1];
+        switch (Op) {
+        case '+':
+        case '-':
+            return MakeBinary(Op, std::move(DL), std::move(DR));
+        case '*':
+            return MakeBinary('+', MakeBinary('*', std::move(DL), R->clone()),
+                              MakeBinary('*', L->clone(), std::move(DR)));
+        case '/':
+            return MakeBinary(
+                '/',
+                MakeBinary('-', MakeBinary('*', std::move(DL), R->clone()),
+                           MakeBinary('*', L->clone(), std::move(DR))),
+                MakeBinary('*', R->clone(), R->clone()));
+        }
+        return LogError("cannot differentiate unknown binary operator");
+    }
+    
+    if (auto *Unary = dynamic_cast<UnaryExprAST *>(&Expr)) {
+        return DifferentiateCall(std::string("unary") + Unary->getOpcode(),
+                                 Children, Proto, Arg, Locals);
+    }
+    
+    if (auto *Call = dynamic_cast<CallExprAST *>(&Expr)) {
+        const std::string &Callee = Call->getCallee();
+        if (FunctionDefs.count(Callee)) {
+            return DifferentiateCall(Callee, Children, Proto, Arg, Locals);
+        }
+        if (!BuiltinArity.count(Callee)) {
+            return LogError("cannot differentiate calls to externs");
+        }
+        
+        std::vector<std::unique_ptr<ExprAST>> DArgs;
+        for (auto *Child : Children) {
+            DArgs.push_back(Differentiate(**Child, Proto, Arg, Locals));
+            if (!DArgs.back()) {
+                return nullptr;
+            }
+        }
+        return DifferentiateBuiltin(Callee, Children, std::move(DArgs));
+    }
+    
+    if (dynamic_cast<IfExprAST *>(&Expr)) {
+        auto DThen = Differentiate(**Children[1], Proto, Arg, Locals);
+        auto DElse = Differentiate(**Children[2], Proto, Arg, Locals);
+        if (!DThen || !DElse) {
+            return nullptr;
+        }
+        return MakeIf((*Children[0])->clone(), std::move(DThen),
+                      std::move(DElse));
+    }
+    
+    if (auto *Var = dynamic_cast<VarExprAST *>(&Expr)) {
+        // var n = i in b  =>  var d.N = i', n = i in b', where b' reads d.N
+        // for n; d.N is bound first, since i' sees the scope i sees
+        std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+        LocalDerivatives Inner;
+        for (auto &Local : Locals) {
+            Inner[Local.first] = Local.second->clone();
+        }
+        for (auto &Binding : Var->getVarNames()) {
+            std::unique_ptr<ExprAST> DInit = std::make_unique<NumberExprAST>(0.0);
+            if (Binding.second) {
+                DInit = Differentiate(*Binding.second, Proto, Arg, Inner);
+                if (!DInit) {
+                    return nullptr;
+                }
+            }
+            
+            // Literal derivatives are substituted directly, so MakeBinary
+            // can still drop the terms they zero out
+            if (!dynamic_cast<NumberExprAST *>(DInit.get())) {
+                std::string DName = MakeTempName("d");
+                VarNames.push_back(std::make_pair(DName, std::move(DInit)));
+                DInit = std::make_unique<VariableExprAST>(DName);
+            }
+            VarNames.push_back(std::make_pair(
+                Binding.first, Binding.second ? Binding.second->clone() : nullptr));
+            Inner[Binding.first] = std::move(DInit);
+        }
+        
+        auto DBody = Differentiate(Var->getBody(), Proto, Arg, Inner);
+        if (!DBody) {
+            return nullptr;
+        }
+        return std::make_unique<VarExprAST>(std::move(VarNames), std::move(DBody));
+    }
+    
+    return LogError("cannot differentiate loops or vectors");
+}
+
+/// DeriveFunction — defines the partial derivative of Fn with respect to its
+/// argument Idx, reusing an earlier one; returns its name or "" on error
+static std::string DeriveFunction(const std::string &Fn, unsigned Idx) {
+    auto Key = std::make_pair(Fn, Idx);
+    auto Known = DerivativeNames.find(Key);
+    if (Known != DerivativeNames.end()) {
+        return Known->second;
+    }
+    
+    auto Def = FunctionDefs.find(Fn);
+    if (Def == FunctionDefs.end()) {
+        LogError("cannot differentiate undefined function");
+        return "";
+    }
+    
+    auto &Proto = Def->second->getProto();
+    auto &Args = Proto.getArgs();
+    if (Proto.isArrayArg(Idx)) {
+        LogError("cannot differentiate with respect to an array argument");
+        return "";
+    }
+    
+    std::string Name = "d" + Fn + "d" + Args[Idx];
+    for (auto &Derivative : DerivativeNames) {
+        if (Derivative.second == Name) {
+            LogError("derivative names of two functions clash");
+            return "";
+        }
+    }
+    if (FunctionDefs.count(Name)) {
+        LogError("derivative name is already defined");
+        return "";
+    }
+    
+    // Registering first, so recursive functions find their own derivative
+    DerivativeNames[Key] = Name;
+    NewDerivatives.push_back(Key);
+    
+    // The parsed body, since the passes may have introduced bindings and
+    // floating-point rewrites that only hold for the value, not its slope
+    auto Body = Differentiate(Def->second->getParsedBody(), Proto, Args[Idx],
+                              LocalDerivatives());
+    if (!Body) {
+        return "";
+    }
+    
+    std::vector<bool> ArrayArgs;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+        ArrayArgs.push_back(Proto.isArrayArg(i));
+    }
+    auto DerivativeProto = std::make_unique<PrototypeAST>(
+        Name, Args, false, 0, std::move(ArrayArgs));
+    FunctionDefs[Name] = std::make_unique<FunctionAST>(std::move(DerivativeProto),
+                                                       std::move(Body));
+    return Name;
+}
+
+//===----------------------------------------------------------------------===//
+// Dependency tracking
+//===----------------------------------------------------------------------===//
+
+/// CalleesOf — functions each definition depended on when it was recorded;
+/// a derivative also depends on the function it was derived from
+static std::map<std::string, std::set<std::string>> CalleesOf;
+
+/// CallerDefs, CallerExprs — reverse edges: for each function, the
+/// definitions and the indices into TopLevelExprs that depend on it, kept up
+/// to date as input arrives so a redefinition only visits its dependents
+static std::map<std::string, std::set<std::string>> CallerDefs;
+static std::map<std::string, std::set<unsigned>> CallerExprs;
+
+/// RecordDefDependencies — replaces the recorded dependencies of Name
+static void RecordDefDependencies(const std::string &Name,
+                                  std::set<std::string> Callees) {
+    for (auto &Old : CalleesOf[Name]) {
+        CallerDefs[Old].erase(Name);
+    }
+    for (auto &Callee : Callees) {
+        CallerDefs[Callee].insert(Name);
+    }
+    CalleesOf[Name] = std::move(Callees);
+}
+
+/// RecordExprDependencies — records what the top-level expression at Idx
+/// in TopLevelExprs depends on
+static void RecordExprDependencies(unsigned Idx) {
+    std::set<std::string> Callees;
+    CollectCallees(TopLevelExprs[Idx]->getBody(), Callees);
+    for (auto &Callee : Callees) {
+        CallerExprs[Callee].insert(Idx);
+    }
+}
+
+static bool DeriveArguments(const std::string &FnName,
+                            const std::vector<unsigned> &Idxs);
+
+/// InvalidateDependents — after Name was redefined, finds every definition
+/// and top-level expression that transitively depends on it and reports what
+/// would have to be recomputed. Derivatives of Name are derived again in
+/// place; derivatives that only call them stay valid and are kept
+static void InvalidateDependents(const std::string &Name) {
+    std::set<std::string> Affected = {Name};
+    std::vector<std::string> Worklist = {Name};
+    std::set<unsigned> Exprs;
+    while (!Worklist.empty()) {
+        std::string Cur = Worklist.back();
+        Worklist.pop_back();
+        
+        auto &Users = CallerExprs[Cur];
+        Exprs.insert(Users.begin(), Users.end());
+        for (auto &Caller : CallerDefs[Cur]) {
+            if (Affected.insert(Caller).second) {
+                Worklist.push_back(Caller);
+            }
+        }
+    }
+    
+    fprintf(stderr,
+            "Redefinition of %s affects %u definitions and %u top-level "
+            "expressions\n",
+            Name.c_str(), (unsigned)Affected.size() - 1, (unsigned)Exprs.size());
+    if (DumpAST) {
+        for (unsigned Idx : Exprs) {
+            TopLevelExprs[Idx]->dump();
+        }
+    }
+    
+    // Name itself may have been a derivative, now replaced by the user's
+    // definition; the derivatives of Name are taken out to be derived again
+    std::vector<std::pair<unsigned, std::string>> Stale;
+    for (auto I = DerivativeNames.begin(); I != DerivativeNames.end();) {
+        if (I->second != Name && I->first.first != Name) {
+            ++I;
+            continue;
+        }
+        if (I->second != Name) {
+            Stale.push_back(std::make_pair(I->first.second, I->second));
+            FunctionDefs.erase(I->second);
+        }
+        I = DerivativeNames.erase(I);
+    }
+    
+    auto &Proto = FunctionDefs[Name]->getProto();
+    for (auto &Derivative : Stale) {
+        unsigned Idx = Derivative.first;
+        if (Idx < Proto.getArgs().size() && !Proto.isArrayArg(Idx) &&
+            DeriveArguments(Name, {Idx})) {
+            continue;
+        }
+        
+        // Callers of a derivative that cannot be derived again are left
+        // calling an undefined function
+        const std::string &Dropped = Derivative.second;
+        RecordDefDependencies(Dropped, std::set<std::string>());
+        fprintf(stderr,
+                "Dropped stale derivative %s, still called by %u definitions "
+                "and %u top-level expressions\n",
+                Dropped.c_str(), (unsigned)CallerDefs[Dropped].size(),
+                (unsigned)CallerExprs[Dropped].size());
+    }
 }
 
 //===----------------------------------------------------------------------===//
 // Top-Level parsing
 //===----------------------------------------------------------------------===//
 
+/// OptimizeFunction — runs the per-function passes and dumps the result
+static void OptimizeFunction(FunctionAST &FnAST) {
+    SimplifyFunction(FnAST);
+    ReduceStrengthInFunction(FnAST);
+    RebalanceFunction(FnAST);
+    ContractFunction(FnAST);
+    if (DumpAST) {
+        FnAST.dump();
+    }
+}
+
 static void HandleDefinition() {
-    if (ParseDefinition()) {
+    if (auto FnAST = ParseDefinition()) {
+        // Installing operator so the rest of the input can use it
+        auto &P = FnAST->getProto();
+        if (P.isBinaryOp()) {
+            BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+        }
+        if (P.isUnaryOp()) {
+            UnaryOperators.insert(P.getOperatorName());
+        }
         fprintf(stderr, "Parsed a function definition\n");
+        OptimizeFunction(*FnAST);
+        
+        std::string Name = P.getName();
+        std::set<std::string> Callees;
+        CollectCallees(FnAST->getBody(), Callees);
+        
+        bool Redefined = FunctionDefs.count(Name);
+        FunctionDefs[Name] = std::move(FnAST);
+        RecordDefDependencies(Name, std::move(Callees));
+        if (Redefined) {
+            InvalidateDependents(Name);
+        }
     }
     else {
         // Skipping token for error recovery
@@ -393,8 +2898,13 @@ static void HandleDefinition() {
 }
 
 static void HandleExtern() {
-    if (ParseExtern()) {
+    if (auto ProtoAST = ParseExtern()) {
         fprintf(stderr, "Parsed an extern\n");
+        if (DumpAST) {
+            fprintf(stderr, "extern ");
+            ProtoAST->dump();
+            fprintf(stderr, "\n");
+        }
     }
     else {
         // Skipping token for error recovery
@@ -404,8 +2914,11 @@ static void HandleExtern() {
 
 static void HandleTopLevelExpression() {
     // Evaluating top-level expression into anonymous function
-    if (ParseTopLevelExpr()) {
+    if (auto FnAST = ParseTopLevelExpr()) {
         fprintf(stderr, "Parsed a top-level expression\n");
+        OptimizeFunction(*FnAST);
+        TopLevelExprs.push_back(std::move(FnAST));
+        RecordExprDependencies(TopLevelExprs.size() - 1);
     }
     else {
         // Skipping token for error recovery
@@ -413,7 +2926,69 @@ static void HandleTopLevelExpression() {
     }
 }
 
-/// top ::= definition | external | expression | ';'
+/// grad ::= 'grad' identifier
+/// DeriveArguments — derives FnName with respect to each argument in Idxs,
+/// then optimizes the new derivatives and records their dependencies;
+/// returns false, with none of them kept, if any derivation fails
+static bool DeriveArguments(const std::string &FnName,
+                            const std::vector<unsigned> &Idxs) {
+    NewDerivatives.clear();
+    bool Failed = false;
+    for (unsigned Idx : Idxs) {
+        Failed |= DeriveFunction(FnName, Idx).empty();
+    }
+    
+    // Dropping every derivative of a failed request, even finished ones
+    if (Failed) {
+        for (auto &Key : NewDerivatives) {
+            FunctionDefs.erase(DerivativeNames[Key]);
+            DerivativeNames.erase(Key);
+        }
+        return false;
+    }
+    
+    for (auto &Key : NewDerivatives) {
+        auto &Name = DerivativeNames[Key];
+        fprintf(stderr, "Derived %s\n", Name.c_str());
+        OptimizeFunction(*FunctionDefs[Name]);
+        
+        std::set<std::string> Callees = {Key.first};
+        CollectCallees(FunctionDefs[Name]->getBody(), Callees);
+        RecordDefDependencies(Name, std::move(Callees));
+    }
+    return true;
+}
+
+static void HandleGrad() {
+    // Consuming 'grad'
+    getNextToken();
+    if (CurTok != tok_identifier) {
+        LogError("expected function name after grad");
+        // Skipping token for error recovery
+        getNextToken();
+        return;
+    }
+    
+    std::string FnName = IdentifierStr;
+    getNextToken();
+    
+    auto Def = FunctionDefs.find(FnName);
+    if (Def == FunctionDefs.end()) {
+        LogError("unknown function in grad");
+        return;
+    }
+    
+    std::vector<unsigned> Idxs;
+    for (unsigned i = 0, e = Def->second->getProto().getArgs().size(); i != e;
+         ++i) {
+        if (!Def->second->getProto().isArrayArg(i)) {
+            Idxs.push_back(i);
+        }
+    }
+    DeriveArguments(FnName, Idxs);
+}
+
+/// top ::= definition | external | grad | expression | ';'
 static void MainLoop() {
     while (true) {
         switch (CurTok) {
@@ -431,6 +3006,9 @@ static void MainLoop() {
         case tok_extern:
             HandleExtern();
             break;
+        case tok_grad:
+            HandleGrad();
+            break;
         default:
             HandleTopLevelExpression();
             break;
@@ -442,11 +3020,61 @@ static void MainLoop() {
 // Main driver code
 //===----------------------------------------------------------------------===//
 
-int main() {
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string Opt = argv[i];
+        if (Opt == "--float32") {
+            SinglePrecision = true;
+        }
+        else if (Opt == "--dump-ast") {
+            DumpAST = true;
+        }
+        else if (Opt == "--fast-math") {
+            FastMath.AllowContract = true;
+            FastMath.AllowReassoc = true;
+            FastMath.NoNaNs = true;
+            FastMath.NoInfs = true;
+        }
+        else if (Opt == "--fp-contract") {
+            FastMath.AllowContract = true;
+        }
+        else if (Opt == "--reassoc") {
+            FastMath.AllowReassoc = true;
+        }
+        else if (Opt == "--no-nans") {
+            FastMath.NoNaNs = true;
+        }
+        else if (Opt == "--no-infs") {
+            FastMath.NoInfs = true;
+        }
+        else {
+            fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    
+    BinopPrecedence['='] = 2;
     BinopPrecedence['<'] = 10;
+    BinopPrecedence['>'] = 10;
     BinopPrecedence['+'] = 20;
     BinopPrecedence['-'] = 20;
     BinopPrecedence['*'] = 40;
+    BinopPrecedence['/'] = 40;
+    
+    BuiltinArity["sqrt"] = 1;
+    BuiltinArity["abs"] = 1;
+    BuiltinArity["floor"] = 1;
+    BuiltinArity["min"] = 2;
+    BuiltinArity["max"] = 2;
+    BuiltinArity["fma"] = 3;
+    BuiltinArity["hsum"] = 1;
+    BuiltinArity["hmin"] = 1;
+    BuiltinArity["hmax"] = 1;
+    BuiltinArity["len"] = 1;
+    BuiltinArity["sin"] = 1;
+    BuiltinArity["cos"] = 1;
+    BuiltinArity["exp"] = 1;
+    BuiltinArity["log"] = 1;
     
     fprintf(stderr, "kaleidoscope >>> ");
     getNextToken();
@@ -454,5 +3082,9 @@ int main() {
     // Running main interpreter loop
     MainLoop();
     
+    // Analyzing the whole module once the input is exhausted
+    PruneModule();
+    PropagateConstants();
+    
     return 0;
 }
\ No newline at end of file